@@ -0,0 +1,47 @@
+#include "memory.h"
+
+#include <stdio.h>
+#include <time.h>
+
+// Every user arena gets a heap of its own and the first block of each heap sits right after the
+// heap header. Without colors all of these blocks share one L1 set and evict each other.
+#define ARENAS 128
+#define ROUNDS 20000
+
+static double
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void
+run(const size_t colors) {
+    FtArena* arenas[ARENAS];
+    volatile char* first[ARENAS];
+
+    malloc_config(MallocParam_HeapColors, colors);
+    for (size_t i = 0; i < ARENAS; ++i) {
+        arenas[i] = ft_arena_create();
+        first[i] = ft_arena_malloc(arenas[i], 64);
+    }
+
+    const double start = now_ns();
+    for (size_t r = 0; r < ROUNDS; ++r) {
+        for (size_t i = 0; i < ARENAS; ++i) first[i][0]++;
+    }
+    const double touch = (now_ns() - start) / ((double)ROUNDS * ARENAS);
+
+    printf("colors %zu: %5.2f ns per first block touch\n", colors, touch);
+
+    for (size_t i = 0; i < ARENAS; ++i) ft_arena_destroy(arenas[i]);
+}
+
+int
+main(void) {
+    run(1);
+    run(8);
+    run(1);
+    run(8);
+    return 0;
+}
@@ -2,6 +2,33 @@
 
 #include <stdlib.h>
 
+#define MALLOC_LOCK_WAIT_BUCKETS 32
+
+typedef struct FtArena FtArena; // opaque, an arena of the allocator
+
+typedef enum MallocParam {
+    MallocParam_LockStats = 0, // time contended lock waits, FT_MALLOC_LOCK_STATS
+    MallocParam_Check = 1,     // check touched chunks and walk heaps every N operations, FT_MALLOC_CHECK
+    MallocParam_CheckBudget = 2, // heaps walked per periodic check, FT_MALLOC_CHECK_BUDGET
+    MallocParam_Populate = 3,    // pre-fault new heaps and large chunks, FT_MALLOC_POPULATE
+    MallocParam_MaxHeapSize = 4, // cap of the geometric heap growth in bytes, FT_MALLOC_MAX_HEAP_SIZE
+    MallocParam_SoftLimit = 5,   // bytes mapped before allocations reclaim or fail, 0 for none, FT_MALLOC_SOFT_LIMIT
+    MallocParam_HeapColors = 6,  // cache line offsets new heaps start at, 1 to 8, FT_MALLOC_HEAP_COLORS
+} MallocParam;
+
+// Called when an allocation would fail even after trimming, with the requested size.
+// Returns nonzero when the application released memory and the allocation should be retried
+typedef int (*MallocPressureHandler)(size_t size);
+
+typedef struct MallocStats {
+    size_t total_memory;    // bytes currently mapped for heaps and large chunks
+    size_t trimmed_memory;  // bytes given back by malloc_trim, pages advised away or heaps unmapped
+    size_t released_memory; // bytes of heaps unmapped, by free or by malloc_trim
+    size_t lock_contentions;
+    size_t lock_wait_ns;
+    size_t lock_wait_histogram[MALLOC_LOCK_WAIT_BUCKETS]; // bucket i counts waits in [2^i, 2^(i+1)) ns
+} MallocStats;
+
 void*
 malloc(size_t size);
 
@@ -13,3 +40,39 @@ free(void* ptr);
 
 void
 show_alloc_mem(void);
+
+void
+free_sized(void* ptr, size_t size);
+
+void
+free_aligned_sized(void* ptr, size_t alignment, size_t size);
+
+size_t
+malloc_usable_size(void* ptr);
+
+int
+malloc_trim(size_t pad);
+
+void
+malloc_get_stats(MallocStats* stats);
+
+int
+malloc_config(MallocParam param, size_t value);
+
+int
+malloc_prewarm(size_t size, size_t count);
+
+void
+malloc_set_pressure_handler(MallocPressureHandler handler);
+
+FtArena*
+ft_arena_create(void);
+
+void*
+ft_arena_malloc(FtArena* arena, size_t size);
+
+void
+ft_arena_free(FtArena* arena, void* ptr);
+
+void
+ft_arena_destroy(FtArena* arena);
@@ -2,9 +2,36 @@
 
 #include "chunk.h"
 #include "heap.h"
+#include "trace.h"
 #include "utils.h"
 
-#include <sys/mman.h>
+#include <unistd.h>
+
+#define ARENA_SHRINK_PERIOD 8
+
+static u64
+heap_bucket(Heap* heap) {
+    const u64 bucket = heap->used * ARENA_BUCKETS / heap_chunk_space(heap);
+    return bucket < ARENA_BUCKETS ? bucket : ARENA_BUCKETS - 1;
+}
+
+static void
+bucket_insert(Arena* arena, Heap* heap) {
+    Heap** head = &arena->buckets[heap->bucket];
+    heap->bucket_prev = 0;
+    heap->bucket_next = *head;
+    if (*head) (*head)->bucket_prev = heap;
+    *head = heap;
+}
+
+static void
+bucket_remove(Arena* arena, Heap* heap) {
+    if (heap->bucket_prev)
+        heap->bucket_prev->bucket_next = heap->bucket_next;
+    else
+        arena->buckets[heap->bucket] = heap->bucket_next;
+    if (heap->bucket_next) heap->bucket_next->bucket_prev = heap->bucket_prev;
+}
 
 static void
 prepend_heap(Arena* arena, Heap* heap) {
@@ -19,51 +46,88 @@ prepend_heap(Arena* arena, Heap* heap) {
     arena->len++;
 }
 
-bool
-arena_grow(Arena* arena) {
-    const u64 size = heap_size(arena->type);
-    Heap* heap = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-    if (mmap_failed(heap)) return false;
+// Doubles the heap size until a new heap is as large as the whole arena, so the heap
+// count stays logarithmic in the footprint
+u64
+arena_heap_size(Arena* arena, const u64 max_size) {
+    const u64 base = heap_size(arena->type);
+    while ((base << arena->scale) < arena->bytes && (base << (arena->scale + 1)) <= max_size) {
+        arena->scale++;
+    }
+    arena->low_usage = 0;
+
+    const u64 size = base << arena->scale;
+    if (size <= max_size) return size;
+
+    return max_size > base ? align_down(max_size, getpagesize()) : base;
+}
+
+// Every mapping starts on a page, the header and first chunk of the heap are placed color
+// bytes past it so that heaps do not all land in the same cache sets
+Heap*
+arena_grow(Arena* arena, void* base, const u64 size, const u64 color) {
+    TRACE2(arena_grow, arena->type, size);
+    arena->bytes += size;
+
+    Heap* heap = (Heap*)((char*)base + color);
+    heap->color = color;
 
     prepend_heap(arena, heap);
 
     Chunk* chunk = heap_to_chunk(heap);
-    chunk->size = size - heap_metadata_size();
+    chunk->size = size - color - heap_metadata_size();
     chunk->flags = ChunkFlag_First | ChunkFlag_Last;
+    chunk_set_magic(chunk);
 
     heap->size = size;
+    heap->used = 0;
+    heap->arena = arena;
     heap->freelist.head = chunk;
     chunk->next = 0;
     chunk->prev = 0;
 
-    return true;
+    heap->bucket = 0;
+    bucket_insert(arena, heap);
+
+    return heap;
 }
 
+// Takes the first fit from the fullest heaps, so the emptiest ones drain and can be released
 Heap*
-arena_find_heap(Arena* arena, void* ptr) {
-    Heap* heap = arena->head;
-    while (heap) {
-        if (ptr_in_heap(heap, ptr)) return heap;
-        heap = heap->next;
+arena_find_chunk(Arena* arena, const u64 size, Chunk** chunk) {
+    for (u64 i = ARENA_BUCKETS; i > 0; --i) {
+        Heap* heap = arena->buckets[i - 1];
+        while (heap) {
+            *chunk = heap_find_chunk(heap, size);
+            if (*chunk) return heap;
+            heap = heap->bucket_next;
+        }
     }
-
     return 0;
 }
 
-Chunk*
-arena_find_chunk(Arena* arena, const u64 size) {
-    Chunk* chunk = 0;
-    Heap* heap = arena->head;
-    while (heap) {
-        chunk = heap_find_chunk(heap, size);
-        if (chunk) break;
-        heap = heap->next;
-    }
-    return chunk;
+void
+arena_update_heap(Arena* arena, Heap* heap) {
+    const u64 bucket = heap_bucket(heap);
+    if (bucket == heap->bucket) return;
+
+    bucket_remove(arena, heap);
+    heap->bucket = bucket;
+    bucket_insert(arena, heap);
 }
 
 void
 arena_remove_heap(Arena* arena, Heap* heap) {
+    arena->bytes -= heap->size;
+    if (arena->scale && arena->bytes < (heap_size(arena->type) << arena->scale) / 4) {
+        if (++arena->low_usage >= ARENA_SHRINK_PERIOD) {
+            arena->scale--;
+            arena->low_usage = 0;
+        }
+    }
+
+    bucket_remove(arena, heap);
+
     Heap* ptr = arena->head;
     arena->len--;
     if (ptr == heap) {
@@ -82,6 +146,17 @@ arena_remove_heap(Arena* arena, Heap* heap) {
     }
 }
 
+u64
+arena_capacity(Arena* arena, const u64 size) {
+    u64 count = 0;
+    Heap* heap = arena->head;
+    while (heap) {
+        count += heap_capacity(heap, size);
+        heap = heap->next;
+    }
+    return count;
+}
+
 ArenaType
 arena_select(const u64 size) {
     if (size <= chunk_max_tiny_size())
@@ -89,3 +164,36 @@ arena_select(const u64 size) {
     else
         return ArenaType_Small;
 }
+
+static u64
+fastbin_index(const u64 size) {
+    return (size - chunk_min_size()) / chunk_alignment();
+}
+
+bool
+arena_fastbin_push(Arena* arena, Chunk* chunk) {
+    if (arena->type != ArenaType_Tiny || chunk->size > chunk_max_fast_size()) return false;
+
+    const u64 idx = fastbin_index(chunk->size);
+    chunk->flags |= ChunkFlag_Fast;
+    chunk->next = arena->fastbins[idx];
+    arena->fastbins[idx] = chunk;
+    arena->fast_count++;
+
+    return true;
+}
+
+Chunk*
+arena_fastbin_pop(Arena* arena, const u64 size) {
+    if (arena->type != ArenaType_Tiny || size > chunk_max_fast_size()) return 0;
+
+    const u64 idx = fastbin_index(size);
+    Chunk* chunk = arena->fastbins[idx];
+    if (!chunk) return 0;
+
+    arena->fastbins[idx] = chunk->next;
+    arena->fast_count--;
+    chunk->flags &= ~ChunkFlag_Fast;
+
+    return chunk;
+}
@@ -4,17 +4,29 @@
 
 #include <stdbool.h>
 
-bool
-arena_grow(Arena* arena);
+u64
+arena_heap_size(Arena* arena, const u64 max_size);
 
 Heap*
-arena_find_heap(Arena* arena, void* ptr);
+arena_grow(Arena* arena, void* base, const u64 size, const u64 color);
 
-Chunk*
-arena_find_chunk(Arena* arena, const u64 size);
+Heap*
+arena_find_chunk(Arena* arena, const u64 size, Chunk** chunk);
+
+void
+arena_update_heap(Arena* arena, Heap* heap);
 
 void
 arena_remove_heap(Arena* arena, Heap* heap);
 
+u64
+arena_capacity(Arena* arena, const u64 size);
+
 ArenaType
 arena_select(const u64 size);
+
+bool
+arena_fastbin_push(Arena* arena, Chunk* chunk);
+
+Chunk*
+arena_fastbin_pop(Arena* arena, const u64 size);
@@ -29,6 +29,11 @@ chunk_min_large_size(void) {
     return align_up(4096 * 4, chunk_alignment());
 }
 
+u64
+chunk_max_fast_size(void) {
+    return chunk_min_size() + (ARENA_FASTBINS - 1) * chunk_alignment();
+}
+
 u64
 mapped_chunk_metadata_size(void) {
     return align_up(sizeof(MappedChunk), chunk_alignment());
@@ -103,6 +108,7 @@ chunk_coalesce(Chunk* front, Chunk* back) {
     const bool back_is_last = back->flags & ChunkFlag_Last;
 
     front->size += back->size;
+    front->flags &= ~ChunkFlag_Trimmed;
     if (back_is_last)
         front->flags |= ChunkFlag_Last;
     else
@@ -114,19 +120,23 @@ chunk_coalesce(Chunk* front, Chunk* back) {
 Chunk*
 chunk_split(Chunk* chunk, const u64 size) {
     const bool is_last = chunk->flags & ChunkFlag_Last;
+    const bool is_trimmed = chunk->flags & ChunkFlag_Trimmed;
     const u64 old_size = chunk->size;
     chunk->size = size;
-    chunk->flags &= ~ChunkFlag_Last;
+    chunk->flags &= ~(ChunkFlag_Last | ChunkFlag_Trimmed);
 
     Chunk* next = chunk_next(chunk);
     next->prev_size = size;
     next->size = old_size - size;
+    chunk_set_magic(next);
     if (is_last) {
         next->flags = ChunkFlag_Last;
     } else {
         next->flags = 0;
         chunk_set_footer(next);
     }
+    // the advised pages of the tail stay untouched, only its header is written
+    if (is_trimmed) next->flags |= ChunkFlag_Trimmed;
 
     return next;
 }
@@ -140,3 +150,29 @@ bool
 chunk_is_allocated(Chunk* chunk) {
     return chunk_is_mapped(chunk) ? true : chunk->flags & ChunkFlag_Allocated;
 }
+
+bool
+chunk_is_fast(Chunk* chunk) {
+    return chunk->flags & ChunkFlag_Fast;
+}
+
+bool
+chunk_is_in_use(Chunk* chunk) {
+    return chunk_is_allocated(chunk) && !chunk_is_fast(chunk);
+}
+
+static u64
+chunk_magic(Chunk* chunk) {
+    const u64 addr = (u64)chunk;
+    return ((addr >> 4) ^ (addr >> 12) ^ 0xA5) & 0xFF;
+}
+
+void
+chunk_set_magic(Chunk* chunk) {
+    chunk->magic = chunk_magic(chunk);
+}
+
+bool
+chunk_has_magic(Chunk* chunk) {
+    return chunk->magic == chunk_magic(chunk);
+}
@@ -16,6 +16,9 @@ chunk_max_tiny_size(void);
 u64
 chunk_min_large_size(void);
 
+u64
+chunk_max_fast_size(void);
+
 u64
 chunk_metadata_size(const bool is_mapped);
 
@@ -63,3 +66,15 @@ chunk_is_mapped(Chunk* chunk);
 
 bool
 chunk_is_allocated(Chunk* chunk);
+
+bool
+chunk_is_fast(Chunk* chunk);
+
+bool
+chunk_is_in_use(Chunk* chunk);
+
+void
+chunk_set_magic(Chunk* chunk);
+
+bool
+chunk_has_magic(Chunk* chunk);
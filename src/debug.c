@@ -1,21 +1,98 @@
+#include "debug.h"
+
 #include "chunk.h"
 #include "heap.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <unistd.h>
 
-#include <assert.h>
+void
+report_corruption(const char* what, void* addr, Heap* heap) {
+    ft_putstr_fd(STDERR_FILENO, "malloc: ");
+    ft_putstr_fd(STDERR_FILENO, what);
+    ft_putstr_fd(STDERR_FILENO, " at 0x");
+    ft_putnbr_fd(STDERR_FILENO, (u64)addr, 16);
+    if (heap) {
+        ft_putstr_fd(STDERR_FILENO, " in heap 0x");
+        ft_putnbr_fd(STDERR_FILENO, (u64)heap, 16);
+    }
+    ft_putstr_fd(STDERR_FILENO, "\n");
+    abort();
+}
+
+void
+check_chunk(Heap* heap, Chunk* chunk) {
+    if (!chunk_has_magic(chunk)) report_corruption("corrupted chunk header", chunk, heap);
+
+    Chunk* prev = chunk_prev(chunk);
+    if (prev && (!chunk_has_magic(prev) || prev->size != chunk->prev_size)) {
+        report_corruption("corrupted previous chunk", prev, heap);
+    }
+
+    Chunk* next = chunk_next(chunk);
+    if (next && (!chunk_has_magic(next) || next->prev_size != chunk->size)) {
+        report_corruption("corrupted next chunk", next, heap);
+    }
+}
+
+void
+check_heap(Heap* heap) {
+    u64 size = 0;
+    u64 used = 0;
+    Chunk* chunk = heap_to_chunk(heap);
+    while (chunk) {
+        if (!chunk_has_magic(chunk) || chunk->size < chunk_min_size()) {
+            report_corruption("corrupted chunk header", chunk, heap);
+        }
+        size += chunk->size;
+        if (chunk_is_allocated(chunk)) used += chunk->size;
+        if (size > heap_chunk_space(heap)) report_corruption("chunk overflows heap", chunk, heap);
+
+        Chunk* next = chunk_next(chunk);
+        if (next && next->prev_size != chunk->size) report_corruption("corrupted chunk footer", next, heap);
+        chunk = next;
+    }
+
+    if (size != heap_chunk_space(heap)) report_corruption("truncated heap", heap, heap);
+    if (used != heap->used) report_corruption("heap usage out of sync", heap, heap);
+}
+
+void
+check_heaps(Arena* arena, const u64 budget) {
+    if (!arena->head) return;
+    if (arena->check_cursor >= arena->len) arena->check_cursor = 0;
+
+    Heap* heap = arena->head;
+    for (u64 i = 0; i < arena->check_cursor; ++i) heap = heap->next;
+
+    for (u64 i = 0; i < budget && i < arena->len; ++i) {
+        check_heap(heap);
+        arena->check_cursor++;
+        heap = heap->next;
+        if (!heap) {
+            heap = arena->head;
+            arena->check_cursor = 0;
+        }
+    }
+}
 
 void
 check_all_mem(Arena* arena) {
     Heap* heap = arena->head;
     while (heap) {
-        Chunk* chunk = heap_to_chunk(heap);
-        while (chunk) {
-            Chunk* next = chunk_next(chunk);
-            if (next && next->prev_size != chunk->size) {
-                volatile char* ptr = 0;
-                *ptr = 1;
-            }
-            chunk = next;
-        }
+        check_heap(heap);
         heap = heap->next;
     }
 }
+
+void
+check_chunk_size(Chunk* chunk, const u64 size) {
+    if (!chunk_is_in_use(chunk)) report_corruption("sized free of a free chunk", chunk, 0);
+    if (chunk_usable_size(chunk) < size) report_corruption("sized free larger than the chunk", chunk, 0);
+
+    // an unsplit remainder leaves an arena chunk less than chunk_min_size() past the request
+    const bool understated = chunk_is_mapped(chunk) ? chunk->size != chunk_mapped_size(size)
+                                                    : chunk->size >= chunk_unmapped_size(size) + chunk_min_size();
+    if (understated) report_corruption("sized free smaller than the chunk", chunk, 0);
+}
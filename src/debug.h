@@ -2,5 +2,20 @@
 
 #include "types.h"
 
+void
+report_corruption(const char* what, void* addr, Heap* heap);
+
+void
+check_chunk(Heap* heap, Chunk* chunk);
+
+void
+check_heap(Heap* heap);
+
+void
+check_heaps(Arena* arena, const u64 budget);
+
 void
 check_all_mem(Arena* arena);
+
+void
+check_chunk_size(Chunk* chunk, const u64 size);
@@ -3,6 +3,7 @@
 #include "chunk.h"
 #include "utils.h"
 
+#include <sys/mman.h>
 #include <unistd.h>
 
 u64
@@ -23,9 +24,24 @@ heap_metadata_size(void) {
     return align_up(sizeof(Heap), chunk_alignment());
 }
 
+u64
+heap_max_color(void) {
+    return (HEAP_COLORS - 1) * HEAP_COLOR_STEP;
+}
+
+void*
+heap_base(Heap* heap) {
+    return (char*)heap - heap->color;
+}
+
+u64
+heap_chunk_space(Heap* heap) {
+    return heap->size - heap->color - heap_metadata_size();
+}
+
 bool
 ptr_in_heap(Heap* heap, void* ptr) {
-    return (u64)heap < (u64)ptr && (u64)heap + heap->size >= (u64)ptr;
+    return (u64)heap < (u64)ptr && (u64)heap_base(heap) + heap->size >= (u64)ptr;
 }
 
 Chunk*
@@ -42,3 +58,54 @@ heap_find_chunk(Heap* heap, const u64 size) {
     }
     return 0;
 }
+
+bool
+heap_is_empty(Heap* heap) {
+    Chunk* chunk = heap_to_chunk(heap);
+    return !chunk_is_allocated(chunk) && chunk->flags & ChunkFlag_Last;
+}
+
+u64
+heap_trim(Heap* heap) {
+    const u64 page_size = getpagesize();
+
+    u64 trimmed = 0;
+    Chunk* chunk = heap->freelist.head;
+    while (chunk) {
+        // keep the header and freelist links, the footer lives in the next chunk
+        const u64 start = align_up((u64)chunk + sizeof(Chunk), page_size);
+        const u64 end = align_down((u64)chunk + chunk->size, page_size);
+        // the flag goes away as soon as the chunk is split, coalesced or handed out
+        const bool is_trimmed = chunk->flags & ChunkFlag_Trimmed;
+        if (!is_trimmed && (end <= start || madvise((void*)start, end - start, MADV_DONTNEED) == 0)) {
+            chunk->flags |= ChunkFlag_Trimmed;
+            if (end > start) trimmed += end - start;
+        }
+        chunk = chunk->next;
+    }
+
+    return trimmed;
+}
+
+u64
+heap_capacity(Heap* heap, const u64 size) {
+    u64 count = 0;
+    Chunk* chunk = heap->freelist.head;
+    while (chunk) {
+        count += chunk->size / size;
+        chunk = chunk->next;
+    }
+    return count;
+}
+
+void
+heap_prefault(Heap* heap) {
+    Chunk* chunk = heap->freelist.head;
+    while (chunk) {
+        // same range as heap_trim, the header and freelist links are left alone
+        const u64 start = (u64)chunk + sizeof(Chunk);
+        prefault_pages((void*)start, (u64)chunk + chunk->size - start);
+        chunk->flags &= ~ChunkFlag_Trimmed;
+        chunk = chunk->next;
+    }
+}
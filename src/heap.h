@@ -10,6 +10,15 @@ heap_size(const ArenaType type);
 u64
 heap_metadata_size(void);
 
+u64
+heap_max_color(void);
+
+void*
+heap_base(Heap* heap);
+
+u64
+heap_chunk_space(Heap* heap);
+
 bool
 ptr_in_heap(Heap* heap, void* ptr);
 
@@ -18,3 +27,15 @@ heap_to_chunk(Heap* heap);
 
 Chunk*
 heap_find_chunk(Heap* heap, const u64 size);
+
+bool
+heap_is_empty(Heap* heap);
+
+u64
+heap_trim(Heap* heap);
+
+u64
+heap_capacity(Heap* heap, const u64 size);
+
+void
+heap_prefault(Heap* heap);
@@ -0,0 +1,48 @@
+#include "lock.h"
+
+#include "trace.h"
+
+#include <time.h>
+
+static u64
+now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + (u64)ts.tv_nsec;
+}
+
+static u64
+wait_bucket(const u64 ns) {
+    const u64 bucket = 63 - __builtin_clzll(ns | 1);
+    return bucket < LOCK_WAIT_BUCKETS ? bucket : LOCK_WAIT_BUCKETS - 1;
+}
+
+void
+lock_init(Lock* lock) {
+    pthread_mutex_init(&lock->mtx, 0);
+}
+
+void
+lock_acquire(Lock* lock, const bool timed) {
+    if (!timed) {
+        pthread_mutex_lock(&lock->mtx);
+        return;
+    }
+
+    if (pthread_mutex_trylock(&lock->mtx) == 0) return;
+
+    const u64 start = now_ns();
+    pthread_mutex_lock(&lock->mtx);
+    const u64 wait = now_ns() - start;
+
+    // the stats are guarded by the lock itself
+    lock->contentions++;
+    lock->wait_ns += wait;
+    lock->wait_histogram[wait_bucket(wait)]++;
+    TRACE2(lock_wait, lock, wait);
+}
+
+void
+lock_release(Lock* lock) {
+    pthread_mutex_unlock(&lock->mtx);
+}
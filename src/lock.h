@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define LOCK_WAIT_BUCKETS 32
+
+typedef struct Lock {
+    pthread_mutex_t mtx;
+    u64 contentions;
+    u64 wait_ns;
+    u64 wait_histogram[LOCK_WAIT_BUCKETS]; // bucket i counts waits in [2^i, 2^(i+1)) ns
+} Lock;
+
+void
+lock_init(Lock* lock);
+
+void
+lock_acquire(Lock* lock, const bool timed);
+
+void
+lock_release(Lock* lock);
@@ -1,73 +1,226 @@
+#include "memory.h"
+
 #include "arena.h"
 #include "chunk.h"
 #include "freelist.h"
 #include "heap.h"
+#include "lock.h"
+#include "region.h"
+#include "report.h"
+#include "trace.h"
 #include "utils.h"
 
 #include "debug.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
 #include <unistd.h>
 
+// malloc_config() may change any field while other threads run, they are read through CONFIG()
+typedef struct Config {
+    _Atomic bool lock_stats;
+    _Atomic u64 check_interval; // 0 disables the runtime checks
+    _Atomic u64 check_budget;   // heaps walked every check_interval operations on an arena
+    _Atomic bool populate;
+    _Atomic u64 max_heap_size;
+    _Atomic u64 soft_limit;  // 0 leaves only RLIMIT_AS
+    _Atomic u64 heap_colors; // start offsets new heaps rotate through, at most HEAP_COLORS
+} Config;
+
 typedef struct Context {
     Arena arenas[2];
     MappedChunkList mapped_chunks;
-    u64 total_memory;
+    _Atomic u64 total_memory;
+    _Atomic u64 trimmed_memory;
+    _Atomic u64 released_memory;
+    _Atomic u64 hard_limit; // cached RLIMIT_AS
+    _Atomic u64 limit_age;
+    _Atomic u64 next_color; // shared by all arenas, user arenas included
+    _Atomic MallocPressureHandler pressure_handler;
+    Region region;
+    Config config;
 } Context;
 
 static Context ctx;
-static pthread_mutex_t mtx;
+static Lock arena_locks[2];
+static Lock mapped_lock;
+static Lock region_lock;
+
+#define LIMIT_REFRESH_PERIOD 1024
+
+#define CONFIG(field)            atomic_load_explicit(&ctx.config.field, memory_order_relaxed)
+#define SET_CONFIG(field, value) atomic_store_explicit(&ctx.config.field, (value), memory_order_relaxed)
+
+_Static_assert(LOCK_WAIT_BUCKETS == MALLOC_LOCK_WAIT_BUCKETS, "lock histogram size mismatch");
+
+static u64
+env_option(const char* name, const u64 fallback) {
+    const char* env = getenv(name);
+    return env ? ft_atou(env) : fallback;
+}
+
+static u64
+region_reserve_size(void) {
+    u64 size = (u64)64 << 30;
+
+    // the reservation counts against RLIMIT_AS, leave most of the limit to the rest of the process
+    struct rlimit rlp;
+    if (getrlimit(RLIMIT_AS, &rlp) == 0 && rlp.rlim_cur != RLIM_INFINITY && rlp.rlim_cur / 4 < size) {
+        size = align_down(rlp.rlim_cur / 4, getpagesize());
+    }
+
+    return size;
+}
+
+static void
+init_context(void) {
+    ctx.arenas[ArenaType_Tiny].type = ArenaType_Tiny;
+    ctx.arenas[ArenaType_Small].type = ArenaType_Small;
+    lock_init(&arena_locks[ArenaType_Tiny]);
+    lock_init(&arena_locks[ArenaType_Small]);
+    lock_init(&mapped_lock);
+    lock_init(&region_lock);
+
+    SET_CONFIG(lock_stats, env_option("FT_MALLOC_LOCK_STATS", 0) != 0);
+    SET_CONFIG(check_interval, env_option("FT_MALLOC_CHECK", 0));
+    SET_CONFIG(check_budget, env_option("FT_MALLOC_CHECK_BUDGET", 1));
+    SET_CONFIG(populate, env_option("FT_MALLOC_POPULATE", 0) != 0);
+    SET_CONFIG(max_heap_size, env_option("FT_MALLOC_MAX_HEAP_SIZE", (u64)64 << 20));
+    SET_CONFIG(soft_limit, env_option("FT_MALLOC_SOFT_LIMIT", 0));
+    SET_CONFIG(heap_colors, env_option("FT_MALLOC_HEAP_COLORS", HEAP_COLORS));
+
+    region_reserve(&ctx.region, region_reserve_size());
+}
 
+// Threads making their first call at the same time must not reserve the region twice
 static void
 init(void) {
-    static bool is_init = false;
-    if (!is_init) {
-        is_init = true;
-        ctx.arenas[ArenaType_Tiny].type = ArenaType_Tiny;
-        ctx.arenas[ArenaType_Small].type = ArenaType_Small;
-        pthread_mutex_init(&mtx, 0);
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_context);
+}
+
+static void
+lock_arena(Arena* arena) {
+    if (arena->type == ArenaType_User) return;
+    lock_acquire(&arena_locks[arena->type], CONFIG(lock_stats));
+}
+
+static void
+unlock_arena(Arena* arena) {
+#ifdef MALLOC_DEBUG
+    check_all_mem(arena);
+#endif
+    if (arena->type == ArenaType_User) return;
+    lock_release(&arena_locks[arena->type]);
+}
+
+static bool
+checks_enabled(void) {
+    return CONFIG(check_interval) != 0;
+}
+
+static void
+check_tick(Arena* arena) {
+    const u64 interval = CONFIG(check_interval); // read once, it may drop to 0 under us
+    if (!interval) return;
+    if (++arena->check_ops % interval == 0) check_heaps(arena, CONFIG(check_budget));
+}
+
+// Verifies the header and neighbours of a chunk that is about to be freed or resized
+static void
+check_touched(Arena* arena, Heap* heap, Chunk* chunk) {
+    if (!checks_enabled()) return;
+    check_chunk(heap, chunk);
+    if (!chunk_is_in_use(chunk)) report_corruption("free of a chunk not in use", chunk, heap);
+    check_tick(arena);
+}
+
+static void
+check_mapped(Chunk* chunk) {
+    if (checks_enabled() && !chunk_has_magic(chunk)) report_corruption("corrupted chunk header", chunk, 0);
+}
+
+// RLIMIT_AS is read again every LIMIT_REFRESH_PERIOD calls, or on demand before a growth is refused
+static u64
+memory_limit(const bool refresh) {
+    if (refresh || atomic_fetch_add(&ctx.limit_age, 1) % LIMIT_REFRESH_PERIOD == 0) {
+        struct rlimit rlp;
+        atomic_store(&ctx.hard_limit, getrlimit(RLIMIT_AS, &rlp) == 0 ? rlp.rlim_cur : 0);
     }
+
+    const u64 limit = atomic_load(&ctx.hard_limit);
+    const u64 soft_limit = CONFIG(soft_limit);
+
+    return soft_limit && soft_limit < limit ? soft_limit : limit;
 }
 
 static bool
 enough_memory(const u64 requested_size) {
-    struct rlimit rlp;
+    const u64 total = atomic_load(&ctx.total_memory) + requested_size;
+    if (total < memory_limit(false)) return true;
+
+    // A fresh RLIMIT_AS can only matter when it is the binding limit
+    const u64 soft_limit = CONFIG(soft_limit);
+    if (soft_limit && soft_limit < atomic_load(&ctx.hard_limit)) return false;
 
-    if (getrlimit(RLIMIT_AS, &rlp) == -1) return false;
+    return total < memory_limit(true);
+}
 
-    return ctx.total_memory + requested_size < rlp.rlim_cur;
+static void
+add_mapped_chunk(MappedChunk* mapped) {
+    lock_acquire(&mapped_lock, CONFIG(lock_stats));
+    mapped->prev = 0;
+    mapped->next = ctx.mapped_chunks.head;
+    if (mapped->next) mapped->next->prev = mapped;
+    ctx.mapped_chunks.head = mapped;
+    lock_release(&mapped_lock);
 }
 
 static void
 remove_mapped_chunk(MappedChunk* mapped) {
-    MappedChunk* ptr = ctx.mapped_chunks.head;
-    if (!ptr) return;
+    lock_acquire(&mapped_lock, CONFIG(lock_stats));
+    if (mapped->prev)
+        mapped->prev->next = mapped->next;
+    else
+        ctx.mapped_chunks.head = mapped->next;
+    if (mapped->next) mapped->next->prev = mapped->prev;
+    lock_release(&mapped_lock);
+}
 
-    if (mapped == ptr) {
-        ctx.mapped_chunks.head = ptr->next;
-        return;
-    }
+// Heaps in the region are found through its page map, the few mapped outside of it once it is
+// full are on a list of their own. Neither depends on the arena, so no lookup walks an arena
+static Heap*
+owner_heap(void* ptr) {
+    if (region_contains(&ctx.region, ptr)) return region_owner(&ctx.region, ptr);
 
-    MappedChunk* tmp = ptr;
-    ptr = ptr->next;
-    while (ptr) {
-        if (mapped == ptr) {
-            tmp->next = ptr->next;
-            return;
-        }
-        tmp = ptr;
-        ptr = ptr->next;
-    }
+    lock_acquire(&region_lock, CONFIG(lock_stats));
+    Heap* heap = region_find_outside(&ctx.region, ptr);
+    lock_release(&region_lock);
+
+    return heap;
 }
 
-static bool
-memory_is_from_arena(void* ptr) {
-    Heap* heap = arena_find_heap(&ctx.arenas[ArenaType_Tiny], ptr);
-    if (!heap) heap = arena_find_heap(&ctx.arenas[ArenaType_Small], ptr);
+static Heap*
+find_heap(Arena* arena, void* ptr) {
+    Heap* heap = owner_heap(ptr);
+    return heap && heap->arena == arena ? heap : 0;
+}
+
+// Returns the arena owning ptr with its lock held, or 0 with no lock held
+static Arena*
+lock_owner(void* ptr, Heap** heap) {
+    Heap* owner = owner_heap(ptr);
+    if (!owner) return 0;
+
+    Arena* arena = owner->arena;
+    lock_arena(arena);
+    *heap = find_heap(arena, ptr);
+    if (*heap) return arena;
+    unlock_arena(arena);
 
-    return heap != 0;
+    return 0;
 }
 
 static bool
@@ -75,30 +228,150 @@ memory_is_aligned(void* ptr) {
     return align_down((u64)ptr, chunk_alignment()) == (u64)ptr;
 }
 
-static void*
-get_block(Arena* arena, const u64 requested_size) {
-    const u64 size = chunk_unmapped_size(requested_size);
+static void
+release_heap(Arena* arena, Heap* heap) {
+    arena_remove_heap(arena, heap);
+    atomic_fetch_sub(&ctx.total_memory, heap->size);
+    atomic_fetch_add(&ctx.released_memory, heap->size);
+    TRACE2(heap_release, heap, heap->size);
 
-    Chunk* chunk = 0;
-    Heap* heap = arena->head;
-    while (heap) {
-        chunk = heap_find_chunk(heap, size);
-        if (chunk) break;
-        heap = heap->next;
+    if (region_contains(&ctx.region, heap)) {
+        lock_acquire(&region_lock, CONFIG(lock_stats));
+        region_free(&ctx.region, heap_base(heap), heap->size);
+        lock_release(&region_lock);
+    } else {
+        lock_acquire(&region_lock, CONFIG(lock_stats));
+        region_remove_outside(&ctx.region, heap);
+        lock_release(&region_lock);
+        munmap(heap_base(heap), heap->size);
     }
+}
 
-    if (!chunk) {
-        if (!enough_memory(heap_size(arena->type))) return 0;
-        if (!arena_grow(arena)) return 0;
-        ctx.total_memory += arena->head->size;
+// Returns true when the coalesced chunk just grew past half of the heap, the heap is then
+// a candidate for release once the fast bins are consolidated
+static bool
+free_chunk(Arena* arena, Heap* heap, Chunk* chunk) {
+    const u64 threshold = (heap_chunk_space(heap)) / 2;
+    bool was_drained = chunk->size >= threshold;
 
-        heap = arena->head;
-        while (heap) {
-            chunk = heap_find_chunk(heap, size);
-            if (chunk) break;
-            heap = heap->next;
+    chunk->flags &= ~ChunkFlag_Allocated;
+    heap->used -= chunk->size;
+
+    Chunk* prev = chunk_prev(chunk);
+    if (prev && !chunk_is_allocated(prev)) {
+        was_drained |= prev->size >= threshold;
+        freelist_remove(&heap->freelist, prev);
+        chunk = chunk_coalesce(prev, chunk);
+    }
+
+    Chunk* next = chunk_next(chunk);
+    if (next && !chunk_is_allocated(next)) {
+        was_drained |= next->size >= threshold;
+        freelist_remove(&heap->freelist, next);
+        chunk = chunk_coalesce(chunk, next);
+    }
+
+    if (chunk->size == heap_chunk_space(heap) && arena->len > 1) {
+        release_heap(arena, heap);
+        return false;
+    }
+
+    freelist_prepend(&heap->freelist, chunk);
+    arena_update_heap(arena, heap);
+
+    return !was_drained && chunk->size >= threshold;
+}
+
+static void
+consolidate_fastbins(Arena* arena) {
+    for (u64 i = 0; i < ARENA_FASTBINS; ++i) {
+        Chunk* chunk = arena->fastbins[i];
+        arena->fastbins[i] = 0;
+        while (chunk) {
+            Chunk* next = chunk->next;
+            chunk->flags &= ~ChunkFlag_Fast;
+            free_chunk(arena, find_heap(arena, chunk), chunk);
+            chunk = next;
         }
     }
+    arena->fast_count = 0;
+}
+
+static void
+free_block(Arena* arena, Heap* heap, Chunk* chunk) {
+    if (arena_fastbin_push(arena, chunk)) return;
+    if (free_chunk(arena, heap, chunk) && arena->fast_count) consolidate_fastbins(arena);
+}
+
+// Rotates the start offset of new heaps by one cache line, 0 and 1 color turn it off
+static u64
+next_color(void) {
+    const u64 colors = CONFIG(heap_colors);
+    if (colors <= 1) return 0;
+
+    const u64 color = atomic_fetch_add(&ctx.next_color, 1) % (colors < HEAP_COLORS ? colors : HEAP_COLORS);
+    return color * HEAP_COLOR_STEP;
+}
+
+// Heaps are carved from the reserved region, a plain mapping is the fallback once it is full
+static bool
+map_heap(Arena* arena, const u64 size, const bool populate) {
+    if (!enough_memory(size)) return false;
+
+    lock_acquire(&region_lock, CONFIG(lock_stats));
+    void* base = region_alloc(&ctx.region, size, populate);
+    lock_release(&region_lock);
+
+    if (base) {
+        region_set_owner(&ctx.region, arena_grow(arena, base, size, next_color()));
+    } else {
+        base = map_pages(size, populate);
+        if (mmap_failed(base)) return false;
+        Heap* heap = arena_grow(arena, base, size, next_color());
+        lock_acquire(&region_lock, CONFIG(lock_stats));
+        region_add_outside(&ctx.region, heap);
+        lock_release(&region_lock);
+    }
+
+    atomic_fetch_add(&ctx.total_memory, size);
+
+    return true;
+}
+
+// Near the memory limit a doubled heap gives way to the base size, which is then halved down to
+// the smallest heap that holds the chunk, so the room left is not filled with one-chunk heaps
+static bool
+grow_arena(Arena* arena, const u64 chunk_size, const bool populate) {
+    const u64 min_size = align_up(chunk_size + heap_max_color() + heap_metadata_size(), getpagesize());
+    const u64 base_size = heap_size(arena->type) > min_size ? heap_size(arena->type) : min_size;
+
+    const u64 first_size = arena_heap_size(arena, CONFIG(max_heap_size));
+    if (first_size <= min_size) return map_heap(arena, min_size, populate);
+    if (map_heap(arena, first_size, populate)) return true;
+
+    u64 size = base_size < first_size ? base_size : first_size / 2;
+    for (; align_up(size, getpagesize()) > min_size; size /= 2) {
+        if (map_heap(arena, align_up(size, getpagesize()), populate)) return true;
+    }
+
+    return map_heap(arena, min_size, populate);
+}
+
+// Carves a chunk from the free lists, growing the arena when nothing fits
+static Chunk*
+take_chunk(Arena* arena, const u64 size) {
+    Chunk* chunk;
+    Heap* heap = arena_find_chunk(arena, size, &chunk);
+    if (!heap && arena->fast_count) {
+        consolidate_fastbins(arena);
+        heap = arena_find_chunk(arena, size, &chunk);
+    }
+
+    if (!heap) {
+        if (!grow_arena(arena, size, CONFIG(populate))) return 0;
+        heap = arena_find_chunk(arena, size, &chunk);
+        if (!heap) return 0;
+    }
 
     freelist_remove(&heap->freelist, chunk);
 
@@ -107,134 +380,404 @@ get_block(Arena* arena, const u64 requested_size) {
         freelist_prepend(&heap->freelist, other);
     }
 
-    chunk->flags |= ChunkFlag_Allocated;
+    chunk->flags = (chunk->flags | ChunkFlag_Allocated) & ~ChunkFlag_Trimmed;
+    heap->used += chunk->size;
+    arena_update_heap(arena, heap);
+
+    return chunk;
+}
+
+static void*
+get_block(Arena* arena, const u64 requested_size) {
+    const u64 size = chunk_unmapped_size(requested_size);
+    check_tick(arena);
+
+    Chunk* chunk = arena_fastbin_pop(arena, size);
+    if (!chunk) chunk = take_chunk(arena, size);
+
+    return chunk ? chunk_to_mem(chunk) : 0;
+}
+
+static void*
+get_mapped_block(const u64 mapped_size) {
+    if (!enough_memory(mapped_size)) return 0;
+    MappedChunk* mapped = map_pages(mapped_size, CONFIG(populate));
+    if (mmap_failed(mapped)) return 0;
+    TRACE2(large_mmap, mapped, mapped_size);
+
+    atomic_fetch_add(&ctx.total_memory, mapped_size);
+    add_mapped_chunk(mapped);
+
+    Chunk* chunk = chunk_from_mapped(mapped);
+    chunk->flags = ChunkFlag_Mapped;
+    chunk->size = mapped_size;
+    chunk_set_magic(chunk);
 
     return chunk_to_mem(chunk);
 }
 
-void*
-inner_malloc(const u64 size) {
+// Consolidates the fast bins and unmaps the empty heaps beyond pad bytes. With advise, the free
+// pages of the other heaps are given back too
+static u64
+trim_arenas(const u64 pad, const bool advise) {
+    u64 kept = 0;
+    u64 returned = 0;
+
+    for (u64 i = 0; i < 2; ++i) {
+        Arena* arena = &ctx.arenas[i];
+        lock_arena(arena);
+        consolidate_fastbins(arena);
+
+        Heap* heap = arena->head;
+        while (heap) {
+            Heap* next = heap->next;
+            if (!heap_is_empty(heap)) {
+                if (advise) returned += heap_trim(heap);
+            } else if (kept + heap->size <= pad) {
+                kept += heap->size;
+            } else {
+                returned += heap->size;
+                release_heap(arena, heap);
+            }
+            heap = next;
+        }
+        unlock_arena(arena);
+    }
+
+    return returned;
+}
+
+int
+inner_trim(const u64 pad) {
+    const u64 returned = trim_arenas(pad, true);
+    atomic_fetch_add(&ctx.trimmed_memory, returned);
+
+    return returned != 0;
+}
+
+static void*
+try_malloc(const u64 size) {
     const u64 mapped_size = chunk_mapped_size(size);
+    if (mapped_size >= chunk_min_large_size()) return get_mapped_block(mapped_size);
+
+    Arena* arena = &ctx.arenas[arena_select(chunk_unmapped_size(size))];
+    lock_arena(arena);
+    void* block = get_block(arena, size);
+    unlock_arena(arena);
+
+    return block;
+}
+
+// Called with no lock held after an allocation failed, the allocation is retried after every
+// step that freed something. The limits only count mapped bytes, so the first step unmaps the
+// empty heaps and leaves the free pages of the others alone. The second step asks the
+// application through its handler. Returns false once no step is left
+static bool
+relieve_pressure(const u64 size, u64* step) {
+    static _Thread_local bool in_handler = false;
+
+    if (*step == 0) {
+        ++*step;
+        // nothing can make room for a request past the limit itself
+        if (size >= memory_limit(false)) return false;
 
-    if (mapped_size >= chunk_min_large_size()) {
-        if (!enough_memory(mapped_size)) return 0;
-        MappedChunk* mapped = mmap(0, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
-        if (mmap_failed(mapped)) return 0;
+        TRACE2(memory_pressure, size, atomic_load(&ctx.total_memory));
+        if (trim_arenas(0, false)) return true;
+    }
 
-        ctx.total_memory += mapped_size;
+    MallocPressureHandler handler = atomic_load(&ctx.pressure_handler);
+    if (*step > 1 || !handler || in_handler) return false;
+    ++*step;
 
-        mapped->next = ctx.mapped_chunks.head;
-        ctx.mapped_chunks.head = mapped;
+    // an allocation from the handler must not call it again
+    in_handler = true;
+    const bool released = handler(size) != 0;
+    in_handler = false;
 
-        Chunk* chunk = chunk_from_mapped(mapped);
-        chunk->flags = ChunkFlag_Mapped;
-        chunk->size = mapped_size;
+    return released;
+}
 
-        return chunk_to_mem(chunk);
+void*
+inner_malloc(const u64 size) {
+    void* block = try_malloc(size);
+    u64 step = 0;
+    while (!block && relieve_pressure(size, &step)) {
+        block = try_malloc(size);
     }
 
-    const ArenaType idx = arena_select(chunk_unmapped_size(size));
-    void* block = get_block(&ctx.arenas[idx], size);
     return block;
 }
 
 static void
-free_chunk(Arena* arena, Chunk* chunk) {
-    chunk->flags &= ~ChunkFlag_Allocated;
+free_mapped_chunk(Chunk* chunk) {
+    MappedChunk* mapped = chunk_to_mapped(chunk);
+    const u64 size = chunk->size; // a bit-field, the probe macros take its sizeof
+    remove_mapped_chunk(mapped);
+    atomic_fetch_sub(&ctx.total_memory, size);
+    TRACE2(large_munmap, mapped, size);
+    munmap(mapped, size);
+}
 
-    Heap* heap = arena_find_heap(arena, chunk);
-    if (!heap) return;
+void
+inner_free(void* ptr) {
+    Chunk* chunk = chunk_from_mem(ptr);
+    if (!memory_is_aligned(chunk)) return;
+    if (chunk_is_mapped(chunk)) {
+        check_mapped(chunk);
+        free_mapped_chunk(chunk);
+        return;
+    }
 
-    Chunk* prev = chunk_prev(chunk);
-    if (prev && !chunk_is_allocated(prev)) {
-        freelist_remove(&heap->freelist, prev);
-        chunk = chunk_coalesce(prev, chunk);
+    Heap* heap;
+    Arena* arena = lock_owner(ptr, &heap);
+    if (!arena) return;
+
+    check_touched(arena, heap, chunk);
+    if (chunk_is_in_use(chunk)) free_block(arena, heap, chunk);
+    unlock_arena(arena);
+}
+
+// The size is only a debug check, there is no faster path for sized frees: the release build
+// frees like free() and trusts the pointer to be aligned
+void
+inner_free_sized(void* ptr, const u64 size) {
+    Chunk* chunk = chunk_from_mem(ptr);
+#ifdef MALLOC_DEBUG
+    check_chunk_size(chunk, size);
+#else
+    (void)size;
+#endif
+    if (chunk_is_mapped(chunk)) {
+        check_mapped(chunk);
+        free_mapped_chunk(chunk);
+        return;
     }
 
+    Heap* heap;
+    Arena* arena = lock_owner(ptr, &heap);
+    if (!arena) return;
+
+    check_touched(arena, heap, chunk);
+    if (chunk_is_in_use(chunk)) free_block(arena, heap, chunk);
+    unlock_arena(arena);
+}
+
+u64
+inner_usable_size(void* ptr) {
+    Chunk* chunk = chunk_from_mem(ptr);
+    if (!memory_is_aligned(chunk)) return 0;
+    if (chunk_is_mapped(chunk)) return chunk_usable_size(chunk);
+
+    Heap* heap;
+    Arena* arena = lock_owner(ptr, &heap);
+    if (!arena) return 0;
+
+    const u64 size = chunk_is_in_use(chunk) ? chunk_usable_size(chunk) : 0;
+    unlock_arena(arena);
+
+    return size;
+}
+
+static u64
+free_size(Chunk* chunk) {
+    return chunk && !chunk_is_allocated(chunk) ? chunk->size : 0;
+}
+
+// Absorbs the free next chunk, and the free previous chunk when that is not enough.
+// Returns the grown chunk, which starts at the previous chunk when it was absorbed
+static Chunk*
+grow_in_place(Arena* arena, Heap* heap, Chunk* chunk, const u64 size) {
+    const u64 new_size = chunk_unmapped_size(size);
     Chunk* next = chunk_next(chunk);
-    if (next && !chunk_is_allocated(next)) {
+    Chunk* prev = chunk_prev(chunk);
+    u64 next_size = free_size(next);
+    u64 prev_size = free_size(prev);
+
+    // Fast-binned neighbours still look allocated, hand them back to the free lists before giving up
+    if (chunk->size + next_size + prev_size < new_size && arena->fast_count &&
+        ((next && chunk_is_fast(next)) || (prev && chunk_is_fast(prev)))) {
+        consolidate_fastbins(arena);
+        next = chunk_next(chunk);
+        prev = chunk_prev(chunk);
+        next_size = free_size(next);
+        prev_size = free_size(prev);
+    }
+
+    if (chunk->size + next_size + prev_size < new_size) return 0;
+
+    const u64 old_size = chunk->size;
+    const u64 usable_size = chunk_usable_size(chunk);
+    if (next_size) {
         freelist_remove(&heap->freelist, next);
         chunk = chunk_coalesce(chunk, next);
     }
 
-    if (chunk->size == heap->size - heap_metadata_size() && arena->len > 1) {
-        arena_remove_heap(arena, heap);
-        ctx.total_memory -= heap->size;
-        munmap(heap, heap->size);
-    } else {
-        freelist_prepend(&heap->freelist, chunk);
+    if (chunk->size < new_size) {
+        void* mem = chunk_to_mem(chunk);
+
+        freelist_remove(&heap->freelist, prev);
+        chunk = chunk_coalesce(prev, chunk);
+        chunk->flags |= ChunkFlag_Allocated;
+        ft_memmove(chunk_to_mem(chunk), mem, usable_size);
+    }
+
+    if (chunk->size - new_size >= chunk_min_size()) {
+        Chunk* other = chunk_split(chunk, new_size);
+        freelist_prepend(&heap->freelist, other);
     }
+
+    heap->used += chunk->size - old_size;
+    arena_update_heap(arena, heap);
+
+    return chunk;
 }
 
-void
-inner_free(void* ptr) {
+static void
+shrink_in_place(Arena* arena, Heap* heap, Chunk* chunk, const u64 size) {
+    const u64 new_size = chunk_unmapped_size(size);
+    if (chunk->size - new_size < chunk_min_size()) return;
+
+    Chunk* tail = chunk_split(chunk, new_size);
+    if (free_chunk(arena, heap, tail) && arena->fast_count) consolidate_fastbins(arena);
+}
+
+static void
+shrink_mapped_chunk(Chunk* chunk, const u64 mapped_size) {
+    if (mapped_size >= chunk->size) return;
+
+    MappedChunk* mapped = chunk_to_mapped(chunk);
+    const u64 tail_size = chunk->size - mapped_size;
+
+    lock_acquire(&mapped_lock, CONFIG(lock_stats));
+    chunk->size = mapped_size;
+    lock_release(&mapped_lock);
+
+    atomic_fetch_sub(&ctx.total_memory, tail_size);
+    TRACE2(large_munmap, (char*)mapped + mapped_size, tail_size);
+    munmap((char*)mapped + mapped_size, tail_size);
+}
+
+static void*
+realloc_mapped(void* ptr, const u64 size) {
     Chunk* chunk = chunk_from_mem(ptr);
-    if (!memory_is_aligned(chunk)) return;
-    if (!chunk_is_allocated(chunk)) return;
-    if (chunk_is_mapped(chunk)) {
-        MappedChunk* mapped = chunk_to_mapped(chunk);
-        remove_mapped_chunk(mapped);
-        ctx.total_memory -= chunk->size;
-        munmap(mapped, chunk->size);
-        return;
+    check_mapped(chunk);
+
+    const u64 usable_size = chunk_usable_size(chunk);
+    const u64 mapped_size = chunk_mapped_size(size);
+    if (usable_size >= size && mapped_size >= chunk_min_large_size()) {
+        shrink_mapped_chunk(chunk, mapped_size);
+        return ptr;
     }
 
-    if (!memory_is_from_arena(ptr)) return;
+    void* block = inner_malloc(size);
+    if (!block) return usable_size >= size ? ptr : 0;
+    ft_memcpy(block, ptr, usable_size < size ? usable_size : size);
+    free_mapped_chunk(chunk);
+
+    return block;
+}
+
+// Called with the arena locked, returns with it unlocked. The chunk stays allocated,
+// so its heap cannot go away while the arena is unlocked
+static void*
+move_block(Arena* arena, Heap* heap, Chunk* chunk, const u64 size) {
+    const u64 usable_size = chunk_usable_size(chunk);
+    unlock_arena(arena);
+
+    void* block = inner_malloc(size);
+    if (!block) return 0;
+    ft_memcpy(block, chunk_to_mem(chunk), usable_size < size ? usable_size : size);
+
+    lock_arena(arena);
+    free_block(arena, heap, chunk);
+    unlock_arena(arena);
 
-    const ArenaType idx = arena_select(chunk->size);
-    free_chunk(&ctx.arenas[idx], chunk);
+    return block;
+}
+
+// Grows the arena until count chunks of the size class fit, stocks the fast bin of that
+// size and faults in every free page of the arena
+int
+inner_prewarm(const u64 size, const u64 count) {
+    if (chunk_mapped_size(size) >= chunk_min_large_size()) return 0;
+
+    const u64 chunk_size = chunk_unmapped_size(size);
+    Arena* arena = &ctx.arenas[arena_select(chunk_size)];
+    lock_arena(arena);
+
+    bool result = true;
+    while (result && arena_capacity(arena, chunk_size) < count) result = grow_arena(arena, chunk_size, true);
+
+    if (result && chunk_size <= chunk_max_fast_size()) {
+        for (u64 i = 0; i < count; ++i) {
+            Chunk* chunk = take_chunk(arena, chunk_size);
+            if (!chunk) break;
+            *(volatile char*)chunk_to_mem(chunk) = 0;
+            arena_fastbin_push(arena, chunk);
+        }
+    }
+
+    Heap* heap = arena->head;
+    while (heap) {
+        heap_prefault(heap);
+        heap = heap->next;
+    }
+
+    unlock_arena(arena);
+
+    return result;
 }
 
 void*
 inner_realloc(void* ptr, const u64 size) {
     Chunk* chunk = chunk_from_mem(ptr);
     if (!memory_is_aligned(chunk)) return 0;
-    if (!chunk_is_allocated(chunk)) return 0;
-    if (!chunk_is_mapped(chunk) && !memory_is_from_arena(ptr)) return 0;
+    if (chunk_is_mapped(chunk)) return realloc_mapped(ptr, size);
 
-    if (chunk_usable_size(chunk) >= size) {
-        return ptr;
-    }
+    Heap* heap;
+    Arena* arena = lock_owner(ptr, &heap);
+    if (!arena) return 0;
 
-    const bool new_size_mapped = chunk_mapped_size(size) >= chunk_min_large_size();
-    const bool will_change_arena = arena_select(chunk->size) != arena_select(chunk_unmapped_size(size));
-    if (!(chunk_is_mapped(chunk) || new_size_mapped || will_change_arena)) {
-        const u64 new_size = chunk_unmapped_size(size);
-        Chunk* next = chunk_next(chunk);
-        if (next && !chunk_is_allocated(next) && new_size <= chunk->size + next->size) {
-            const ArenaType arena = arena_select(chunk->size);
-            Heap* heap = arena_find_heap(&ctx.arenas[arena], chunk);
+    check_touched(arena, heap, chunk);
+    if (!chunk_is_in_use(chunk)) {
+        unlock_arena(arena);
+        return 0;
+    }
 
-            freelist_remove(&heap->freelist, next);
+    const u64 new_size = chunk_unmapped_size(size);
+    if (chunk_usable_size(chunk) >= size) {
+        // a move costs a copy, it only pays when the block gives up at least half of its chunk
+        if (arena->type == ArenaType_Small && arena_select(new_size) == ArenaType_Tiny && chunk->size >= 2 * new_size) {
+            void* block = move_block(arena, heap, chunk, size);
+            if (block) return block;
+            lock_arena(arena);
+        }
 
-            chunk = chunk_coalesce(chunk, next);
-            if (chunk->size - new_size >= chunk_min_size()) {
-                Chunk* other = chunk_split(chunk, new_size);
-                freelist_prepend(&heap->freelist, other);
-            }
+        shrink_in_place(arena, heap, chunk, size);
+        unlock_arena(arena);
+        return ptr;
+    }
 
-            return chunk_to_mem(chunk);
+    // Growing past the Tiny limit is fine as long as the chunk stays in its heap
+    if (chunk_mapped_size(size) < chunk_min_large_size()) {
+        Chunk* grown = grow_in_place(arena, heap, chunk, size);
+        if (grown) {
+            unlock_arena(arena);
+            return chunk_to_mem(grown);
         }
     }
 
-    void* block = inner_malloc(size);
-    ft_memcpy(block, ptr, chunk_usable_size(chunk));
-    inner_free(ptr);
-
-    return block;
+    return move_block(arena, heap, chunk, size);
 }
 
 void*
 malloc(size_t size) {
     init();
     if (size == 0) size = 1;
-    pthread_mutex_lock(&mtx);
+
+    TRACE1(malloc_entry, size);
     void* block = inner_malloc(size);
-#ifdef MALLOC_DEBUG
-    check_all_mem(&ctx.arenas[0]);
-    check_all_mem(&ctx.arenas[1]);
-#endif
-    pthread_mutex_unlock(&mtx);
+    TRACE2(malloc_exit, size, block);
 
     return block;
 }
@@ -244,13 +787,9 @@ free(void* ptr) {
     if (!ptr) return;
     init();
 
-    pthread_mutex_lock(&mtx);
+    TRACE1(free_entry, ptr);
     inner_free(ptr);
-#ifdef MALLOC_DEBUG
-    check_all_mem(&ctx.arenas[0]);
-    check_all_mem(&ctx.arenas[1]);
-#endif
-    pthread_mutex_unlock(&mtx);
+    TRACE1(free_exit, ptr);
 }
 
 void*
@@ -262,71 +801,313 @@ realloc(void* ptr, size_t size) {
         return 0;
     }
 
-    pthread_mutex_lock(&mtx);
+    TRACE2(realloc_entry, ptr, size);
     void* block = inner_realloc(ptr, size);
-#ifdef MALLOC_DEBUG
-    check_all_mem(&ctx.arenas[0]);
-    check_all_mem(&ctx.arenas[1]);
-#endif
-    pthread_mutex_unlock(&mtx);
+    TRACE3(realloc_exit, ptr, size, block);
+
+    return block;
+}
+
+void
+free_sized(void* ptr, size_t size) {
+    if (!ptr) return;
+    init();
+
+    TRACE1(free_entry, ptr);
+    inner_free_sized(ptr, size);
+    TRACE1(free_exit, ptr);
+}
+
+void
+free_aligned_sized(void* ptr, size_t alignment, size_t size) {
+    if (!ptr) return;
+    init();
+
+    TRACE1(free_entry, ptr);
+    if (alignment > chunk_alignment()) {
+        // Nothing here allocates above chunk_alignment(), so the caller broke the contract. Take the
+        // checked free() path, which ignores pointers it does not own and skips the size check
+        inner_free(ptr);
+    } else {
+        inner_free_sized(ptr, size);
+    }
+    TRACE1(free_exit, ptr);
+}
+
+size_t
+malloc_usable_size(void* ptr) {
+    if (!ptr) return 0;
+    init();
+
+    return inner_usable_size(ptr);
+}
+
+void
+malloc_set_pressure_handler(MallocPressureHandler handler) {
+    init();
+
+    atomic_store(&ctx.pressure_handler, handler);
+}
+
+int
+malloc_prewarm(size_t size, size_t count) {
+    init();
+    if (size == 0) size = 1;
+
+    return inner_prewarm(size, count);
+}
+
+FtArena*
+ft_arena_create(void) {
+    init();
+
+    Arena* arena = inner_malloc(sizeof(Arena));
+    if (!arena) return 0;
+    *arena = (Arena){ .type = ArenaType_User };
+    TRACE1(arena_create, arena);
+
+    return (FtArena*)arena;
+}
+
+// The caller owns the arena, nothing here takes a lock. A fresh heap is a single free chunk
+// at the head of its freelist, so without frees every allocation splits that chunk: a bump
+void*
+ft_arena_malloc(FtArena* user, size_t size) {
+    Arena* arena = (Arena*)user;
+    if (size == 0) size = 1;
+
+    TRACE2(arena_malloc_entry, arena, size);
+    const u64 chunk_size = chunk_unmapped_size(size);
+    Chunk* chunk = take_chunk(arena, chunk_size);
+    u64 step = 0;
+    while (!chunk && relieve_pressure(size, &step)) {
+        chunk = take_chunk(arena, chunk_size);
+    }
+    void* block = chunk ? chunk_to_mem(chunk) : 0;
+    TRACE3(arena_malloc_exit, arena, size, block);
 
     return block;
 }
 
+void
+ft_arena_free(FtArena* user, void* ptr) {
+    Arena* arena = (Arena*)user;
+    if (!ptr) return;
+
+    TRACE2(arena_free_entry, arena, ptr);
+    Chunk* chunk = chunk_from_mem(ptr);
+    Heap* heap = find_heap(arena, ptr);
+    if (heap) {
+        check_touched(arena, heap, chunk);
+        if (chunk_is_in_use(chunk)) free_block(arena, heap, chunk);
+    }
+    TRACE2(arena_free_exit, arena, ptr);
+}
+
+void
+ft_arena_destroy(FtArena* user) {
+    Arena* arena = (Arena*)user;
+    if (!arena) return;
+
+    TRACE1(arena_destroy_entry, arena);
+    while (arena->head) release_heap(arena, arena->head);
+    inner_free(arena);
+    TRACE1(arena_destroy_exit, arena);
+}
+
+int
+malloc_trim(size_t pad) {
+    init();
+
+    return inner_trim(pad);
+}
+
+void
+malloc_get_stats(MallocStats* stats) {
+    init();
+
+    stats->total_memory = atomic_load(&ctx.total_memory);
+    stats->trimmed_memory = atomic_load(&ctx.trimmed_memory);
+    stats->released_memory = atomic_load(&ctx.released_memory);
+    stats->lock_contentions = 0;
+    stats->lock_wait_ns = 0;
+    for (u64 i = 0; i < LOCK_WAIT_BUCKETS; ++i) stats->lock_wait_histogram[i] = 0;
+
+    Lock* locks[] = { &arena_locks[ArenaType_Tiny], &arena_locks[ArenaType_Small], &mapped_lock, &region_lock };
+    for (u64 i = 0; i < sizeof(locks) / sizeof(*locks); ++i) {
+        lock_acquire(locks[i], false);
+        stats->lock_contentions += locks[i]->contentions;
+        stats->lock_wait_ns += locks[i]->wait_ns;
+        for (u64 j = 0; j < LOCK_WAIT_BUCKETS; ++j) stats->lock_wait_histogram[j] += locks[i]->wait_histogram[j];
+        lock_release(locks[i]);
+    }
+}
+
+int
+malloc_config(MallocParam param, size_t value) {
+    init();
+
+    switch (param) {
+        case MallocParam_LockStats:
+            SET_CONFIG(lock_stats, value != 0);
+            return 1;
+        case MallocParam_Check:
+            SET_CONFIG(check_interval, value);
+            return 1;
+        case MallocParam_CheckBudget:
+            SET_CONFIG(check_budget, value);
+            return 1;
+        case MallocParam_Populate:
+            SET_CONFIG(populate, value != 0);
+            return 1;
+        case MallocParam_MaxHeapSize:
+            SET_CONFIG(max_heap_size, value);
+            return 1;
+        case MallocParam_SoftLimit:
+            SET_CONFIG(soft_limit, value);
+            return 1;
+        case MallocParam_HeapColors:
+            SET_CONFIG(heap_colors, value);
+            return 1;
+    }
+
+    return 0;
+}
+
 static void
-print_arena_allocs(const char* name, Arena* arena, u64* total) {
-    Heap* heap = arena->head;
-    while (heap) {
-        ft_putstr(name);
-        ft_putstr(" : 0x");
-        ft_putnbr((u64)heap_to_chunk(heap), 16);
-        ft_putstr("\n");
-        Chunk* chunk = heap_to_chunk(heap);
-        while (chunk) {
-            const u64 addr = (u64)chunk_to_mem(chunk);
-            const unsigned long size = chunk->size;
-            if (chunk_is_allocated(chunk)) {
-                *total += size;
-                ft_putstr("0x");
-                ft_putnbr(addr, 16);
-                ft_putstr(" - 0x");
-                ft_putnbr(addr + chunk->size, 16);
-                ft_putstr(" : ");
-                ft_putnbr(chunk->size, 10);
-                ft_putstr(" bytes\n");
+release_snapshot(Snapshot* snapshot) {
+    if (snapshot->capacity) munmap(snapshot->entries, snapshot->capacity * sizeof(ReportEntry));
+}
+
+static bool
+reserve_snapshot(Snapshot* snapshot, const u64 count) {
+    if (count <= snapshot->capacity) return true;
+
+    const u64 size = align_up(count * sizeof(ReportEntry), getpagesize());
+    ReportEntry* entries = map_pages(size, false);
+    if (mmap_failed(entries)) return false;
+
+    release_snapshot(snapshot);
+    snapshot->entries = entries;
+    snapshot->capacity = size / sizeof(ReportEntry);
+
+    return true;
+}
+
+// Copies the blocks in use of the index-th heap under one short lock hold, false once past the
+// last heap. The list may change between two calls, a heap can then be skipped or listed twice
+static bool
+snapshot_heap(Arena* arena, const u64 index, Snapshot* snapshot) {
+    while (true) {
+        lock_arena(arena);
+        Heap* heap = arena->head;
+        for (u64 i = 0; heap && i < index; ++i) {
+            heap = heap->next;
+        }
+        if (!heap) {
+            unlock_arena(arena);
+            return false;
+        }
+
+        const u64 count = heap_chunk_space(heap) / chunk_min_size();
+        if (count <= snapshot->capacity) {
+            snapshot->start = (u64)heap_to_chunk(heap);
+            snapshot->len = 0;
+            Chunk* chunk = heap_to_chunk(heap);
+            while (chunk) {
+                if (chunk_is_in_use(chunk)) {
+                    snapshot->entries[snapshot->len++] = (ReportEntry){ (u64)chunk_to_mem(chunk), chunk->size };
+                }
+                chunk = chunk_next(chunk);
             }
-            chunk = chunk_next(chunk);
+            unlock_arena(arena);
+            return true;
         }
-        heap = heap->next;
+
+        // the scratch space is mapped without any lock held, then the heap is looked up again
+        unlock_arena(arena);
+        if (!reserve_snapshot(snapshot, count)) return false;
     }
 }
 
+static bool
+snapshot_mapped(Snapshot* snapshot) {
+    while (true) {
+        lock_acquire(&mapped_lock, CONFIG(lock_stats));
+        u64 count = 0;
+        for (MappedChunk* ptr = ctx.mapped_chunks.head; ptr; ptr = ptr->next) {
+            count++;
+        }
+
+        if (count <= snapshot->capacity) {
+            snapshot->len = 0;
+            MappedChunk* ptr = ctx.mapped_chunks.head;
+            while (ptr) {
+                snapshot->entries[snapshot->len++] = (ReportEntry){ (u64)ptr, chunk_from_mapped(ptr)->size };
+                ptr = ptr->next;
+            }
+            lock_release(&mapped_lock);
+            return true;
+        }
+
+        lock_release(&mapped_lock);
+        if (!reserve_snapshot(snapshot, count)) return false;
+    }
+}
+
+static void
+report_block(Report* report, const u64 addr, const u64 size) {
+    report_putstr(report, "0x");
+    report_putnbr(report, addr, 16);
+    report_putstr(report, " - 0x");
+    report_putnbr(report, addr + size, 16);
+    report_putstr(report, " : ");
+    report_putnbr(report, size, 10);
+    report_putstr(report, " bytes\n");
+}
+
+static void
+report_arena(Report* report, Snapshot* snapshot, const char* name, Arena* arena, u64* total) {
+    u64 index = 0;
+    while (snapshot_heap(arena, index++, snapshot)) {
+        report_putstr(report, name);
+        report_putstr(report, " : 0x");
+        report_putnbr(report, snapshot->start, 16);
+        report_putstr(report, "\n");
+        for (u64 i = 0; i < snapshot->len; ++i) {
+            *total += snapshot->entries[i].size;
+            report_block(report, snapshot->entries[i].addr, snapshot->entries[i].size);
+        }
+    }
+}
+
+// The report is formatted outside of the locks into a buffer that is written out in large blocks
 void
 show_alloc_mem(void) {
-    pthread_mutex_lock(&mtx);
+    init();
+
+    Report report = { .fd = STDOUT_FILENO };
+    Snapshot snapshot = { 0 };
     u64 total = 0;
-    print_arena_allocs("TINY", &ctx.arenas[ArenaType_Tiny], &total);
-    print_arena_allocs("SMALL", &ctx.arenas[ArenaType_Small], &total);
-
-    MappedChunk* ptr = ctx.mapped_chunks.head;
-    while (ptr) {
-        Chunk* chunk = chunk_from_mapped(ptr);
-        u64 addr = (u64)chunk_to_mem(chunk);
-        total += chunk->size;
-        ft_putstr("LARGE : 0x");
-        ft_putnbr((u64)ptr, 16);
-        ft_putstr("\n0x");
-        ft_putnbr((u64)addr, 16);
-        ft_putstr(" - 0x");
-        ft_putnbr((u64)addr + chunk->size, 16);
-        ft_putstr(" : ");
-        ft_putnbr(chunk->size, 10);
-        ft_putstr(" bytes\n");
-        ptr = ptr->next;
-    }
-
-    ft_putstr("Total : ");
-    ft_putnbr(total, 10);
-    ft_putstr(" bytes\n");
-    pthread_mutex_unlock(&mtx);
+
+    report_arena(&report, &snapshot, "TINY", &ctx.arenas[ArenaType_Tiny], &total);
+    report_arena(&report, &snapshot, "SMALL", &ctx.arenas[ArenaType_Small], &total);
+
+    if (snapshot_mapped(&snapshot)) {
+        for (u64 i = 0; i < snapshot.len; ++i) {
+            const u64 addr = (u64)chunk_to_mem(chunk_from_mapped((MappedChunk*)snapshot.entries[i].addr));
+            total += snapshot.entries[i].size;
+            report_putstr(&report, "LARGE : 0x");
+            report_putnbr(&report, snapshot.entries[i].addr, 16);
+            report_putstr(&report, "\n");
+            report_block(&report, addr, snapshot.entries[i].size);
+        }
+    }
+
+    report_putstr(&report, "Total : ");
+    report_putnbr(&report, total, 10);
+    report_putstr(&report, " bytes\n");
+    report_flush(&report);
+
+    release_snapshot(&snapshot);
 }
@@ -0,0 +1,171 @@
+#include "region.h"
+
+#include "heap.h"
+#include "utils.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static u64
+page_index(Region* region, void* ptr) {
+    return ((u64)ptr - (u64)region->base) / getpagesize();
+}
+
+static void
+set_owner(Region* region, void* ptr, const u64 size, Heap* heap) {
+    const u64 first = page_index(region, ptr);
+    const u64 count = size / getpagesize();
+    for (u64 i = 0; i < count; ++i) region->owners[first + i] = heap;
+}
+
+static void
+remove_span(Region* region, const u64 idx) {
+    region->spans[idx] = region->spans[--region->span_count];
+}
+
+// The owner table is reserved like the region itself and committed as heaps reach further into it
+static bool
+commit_owners(Region* region, const u64 end) {
+    const u64 committed = region->owners_committed;
+    const u64 needed = align_up(end / getpagesize() * sizeof(Heap*), getpagesize());
+    if (needed <= committed) return true;
+
+    if (mprotect((char*)region->owners + committed, needed - committed, PROT_READ | PROT_WRITE) == -1) return false;
+    region->owners_committed = needed;
+
+    return true;
+}
+
+static void
+release_range(Region* region, const u64 offset, const u64 size) {
+    RegionSpan freed = { .offset = offset, .size = size };
+    for (u64 i = 0; i < region->span_count; ++i) {
+        RegionSpan* span = &region->spans[i];
+        if (span->offset + span->size == freed.offset) {
+            freed.offset = span->offset;
+            freed.size += span->size;
+        } else if (freed.offset + freed.size == span->offset) {
+            freed.size += span->size;
+        } else {
+            continue;
+        }
+        remove_span(region, i--);
+    }
+
+    if (freed.offset + freed.size == region->used) {
+        region->used = freed.offset;
+    } else if (region->span_count < REGION_SPANS) {
+        region->spans[region->span_count++] = freed;
+    }
+}
+
+bool
+region_reserve(Region* region, const u64 size) {
+    const int flags = MAP_PRIVATE | MAP_ANON | MAP_NORESERVE;
+    const u64 owners_size = align_up(size / getpagesize() * sizeof(Heap*), getpagesize());
+
+    void* base = mmap(0, size, PROT_NONE, flags, -1, 0);
+    if (mmap_failed(base)) return false;
+
+    Heap** owners = mmap(0, owners_size, PROT_NONE, flags, -1, 0);
+    if (mmap_failed(owners)) {
+        munmap(base, size);
+        return false;
+    }
+
+    region->base = base;
+    region->size = size;
+    region->used = 0;
+    region->owners = owners;
+    region->owners_committed = 0;
+    region->span_count = 0;
+
+    return true;
+}
+
+void*
+region_alloc(Region* region, const u64 size, const bool populate) {
+    if (!region->base) return 0;
+
+    u64 offset = region->used;
+    bool from_span = false;
+    for (u64 i = 0; i < region->span_count; ++i) {
+        RegionSpan* span = &region->spans[i];
+        if (span->size < size) continue;
+
+        offset = span->offset;
+        span->offset += size;
+        span->size -= size;
+        if (span->size == 0) remove_span(region, i);
+        from_span = true;
+        break;
+    }
+
+    if (!from_span) {
+        if (region->size - region->used < size) return 0;
+        region->used += size;
+    }
+
+    char* ptr = region->base + offset;
+    if (!commit_owners(region, offset + size) || mprotect(ptr, size, PROT_READ | PROT_WRITE) == -1) {
+        release_range(region, offset, size);
+        return 0;
+    }
+
+    if (populate) {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(ptr, size, MADV_POPULATE_WRITE) == -1) prefault_pages(ptr, size);
+#else
+        prefault_pages(ptr, size);
+#endif
+    }
+
+    return ptr;
+}
+
+// Gives the pages back and keeps the range reserved, a full span list leaks the range
+void
+region_free(Region* region, void* ptr, const u64 size) {
+    mmap(ptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    set_owner(region, ptr, size, 0);
+    release_range(region, (u64)ptr - (u64)region->base, size);
+}
+
+bool
+region_contains(Region* region, void* ptr) {
+    return (u64)ptr >= (u64)region->base && (u64)ptr < (u64)region->base + region->size;
+}
+
+void
+region_set_owner(Region* region, Heap* heap) {
+    set_owner(region, heap_base(heap), heap->size, heap);
+}
+
+// Pages the heaps never reached have no committed owner entry
+Heap*
+region_owner(Region* region, void* ptr) {
+    const u64 idx = page_index(region, ptr);
+    if (idx * sizeof(Heap*) >= region->owners_committed) return 0;
+
+    return region->owners[idx];
+}
+
+void
+region_add_outside(Region* region, Heap* heap) {
+    heap->outside_next = region->outside;
+    region->outside = heap;
+}
+
+void
+region_remove_outside(Region* region, Heap* heap) {
+    Heap** link = &region->outside;
+    while (*link && *link != heap) link = &(*link)->outside_next;
+    if (*link) *link = heap->outside_next;
+}
+
+Heap*
+region_find_outside(Region* region, void* ptr) {
+    Heap* heap = region->outside;
+    while (heap && !ptr_in_heap(heap, ptr)) heap = heap->outside_next;
+    return heap;
+}
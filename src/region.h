@@ -0,0 +1,32 @@
+#pragma once
+
+#include "types.h"
+
+#include <stdbool.h>
+
+bool
+region_reserve(Region* region, const u64 size);
+
+void*
+region_alloc(Region* region, const u64 size, const bool populate);
+
+void
+region_free(Region* region, void* ptr, const u64 size);
+
+bool
+region_contains(Region* region, void* ptr);
+
+void
+region_set_owner(Region* region, Heap* heap);
+
+Heap*
+region_owner(Region* region, void* ptr);
+
+void
+region_add_outside(Region* region, Heap* heap);
+
+void
+region_remove_outside(Region* region, Heap* heap);
+
+Heap*
+region_find_outside(Region* region, void* ptr);
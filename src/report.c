@@ -0,0 +1,38 @@
+#include "report.h"
+
+#include <unistd.h>
+
+void
+report_putstr(Report* report, const char* str) {
+    while (*str) {
+        if (report->len == REPORT_BUFFER_SIZE) report_flush(report);
+        report->buf[report->len++] = *str++;
+    }
+}
+
+void
+report_putnbr(Report* report, const u64 nbr, const u64 base) {
+    const char* hex = "0123456789ABCDEF";
+    char digits[65];
+    u64 i = sizeof(digits) - 1;
+    u64 n = nbr;
+
+    digits[i] = '\0';
+    do {
+        digits[--i] = hex[n % base];
+        n /= base;
+    } while (n);
+
+    report_putstr(report, digits + i);
+}
+
+void
+report_flush(Report* report) {
+    u64 done = 0;
+    while (done < report->len) {
+        const ssize_t ret = write(report->fd, report->buf + done, report->len - done);
+        if (ret <= 0) break;
+        done += ret;
+    }
+    report->len = 0;
+}
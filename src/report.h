@@ -0,0 +1,12 @@
+#pragma once
+
+#include "types.h"
+
+void
+report_putstr(Report* report, const char* str);
+
+void
+report_putnbr(Report* report, const u64 nbr, const u64 base);
+
+void
+report_flush(Report* report);
@@ -0,0 +1,20 @@
+#pragma once
+
+// Static USDT probes under the ft_malloc provider, compiled out when <sys/sdt.h> is missing
+// or MALLOC_NO_PROBES is defined. A disabled probe costs a single nop.
+#if defined(__has_include) && !defined(MALLOC_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define MALLOC_PROBES
+#endif
+#endif
+
+#ifdef MALLOC_PROBES
+#define TRACE1(name, a)       DTRACE_PROBE1(ft_malloc, name, a)
+#define TRACE2(name, a, b)    DTRACE_PROBE2(ft_malloc, name, a, b)
+#define TRACE3(name, a, b, c) DTRACE_PROBE3(ft_malloc, name, a, b, c)
+#else
+#define TRACE1(name, a)       ((void)0)
+#define TRACE2(name, a, b)    ((void)0)
+#define TRACE3(name, a, b, c) ((void)0)
+#endif
@@ -17,18 +17,22 @@ typedef enum ChunkFlag {
     ChunkFlag_Mapped = 1 << 1,
     ChunkFlag_First = 1 << 2,
     ChunkFlag_Last = 1 << 3,
+    ChunkFlag_Fast = 1 << 4,
+    ChunkFlag_Trimmed = 1 << 5, // free chunk whose pages heap_trim already advised away
 } ChunkFlag;
 
 typedef struct Chunk {
     u64 prev_size;
-    u64 flags : 4;
-    u64 size  : 60;
+    u64 flags : 8;
+    u64 magic : 8; // canary derived from the chunk address
+    u64 size  : 48;
     struct Chunk* next; // only use if free
     struct Chunk* prev; // only use if free
 } Chunk;
 
 typedef struct MappedChunk {
     struct MappedChunk* next;
+    struct MappedChunk* prev;
 } MappedChunk;
 
 typedef struct MappedChunkList {
@@ -41,17 +45,76 @@ typedef struct Freelist {
 
 typedef struct Heap {
     Freelist freelist;
-    u64 size;
+    u64 size;  // of the whole mapping, color included
+    u64 color; // offset of this header from the page aligned start of the mapping
+    u64 used; // bytes of the chunks handed out, fast bin chunks included
+    struct Arena* arena;
     struct Heap* next;
+    u64 bucket;
+    struct Heap* bucket_next;
+    struct Heap* bucket_prev;
+    struct Heap* outside_next; // on Region.outside when mapped outside of the region
 } Heap;
 
 typedef enum ArenaType {
     ArenaType_Tiny = 0,
     ArenaType_Small = 1,
+    ArenaType_User = 2, // created by ft_arena_create, never locked
 } ArenaType;
 
+#define ARENA_FASTBINS  7
+#define ARENA_BUCKETS   8
+#define HEAP_COLORS     8
+#define HEAP_COLOR_STEP 64 // a cache line
+
 typedef struct Arena {
     u64 len;
     ArenaType type;
     Heap* head;
+    Heap* buckets[ARENA_BUCKETS]; // heaps by occupancy, bucket i is at most (i + 1) / ARENA_BUCKETS full
+    Chunk* fastbins[ARENA_FASTBINS]; // Tiny only, LIFO, linked with Chunk.next
+    u64 fast_count;
+    u64 check_ops;
+    u64 check_cursor;
+    u64 bytes;       // sum of the heap sizes
+    u64 scale;       // new heaps are heap_size(type) << scale
+    u64 low_usage;   // releases in a row that left the arena well below its heap size
 } Arena;
+
+#define REGION_SPANS 64
+
+typedef struct RegionSpan {
+    u64 offset;
+    u64 size;
+} RegionSpan;
+
+typedef struct Region {
+    char* base;
+    u64 size;
+    u64 used;
+    Heap** owners; // heap of every page of the region
+    _Atomic u64 owners_committed; // bytes at the start of owners that are mapped read-write
+    Heap* outside; // heaps of every arena mapped on their own once the region is full
+    RegionSpan spans[REGION_SPANS];
+    u64 span_count;
+} Region;
+
+#define REPORT_BUFFER_SIZE 4096
+
+typedef struct Report {
+    int fd;
+    u64 len;
+    char buf[REPORT_BUFFER_SIZE];
+} Report;
+
+typedef struct ReportEntry {
+    u64 addr;
+    u64 size;
+} ReportEntry;
+
+typedef struct Snapshot {
+    ReportEntry* entries; // mapped scratch space, never taken from the arenas
+    u64 capacity;
+    u64 len;
+    u64 start;
+} Snapshot;
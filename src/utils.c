@@ -1,5 +1,6 @@
 #include "utils.h"
 
+#include <sys/mman.h>
 #include <unistd.h>
 
 u64
@@ -22,11 +23,50 @@ ft_memcpy(void* dst, const void* src, const u64 size) {
     }
 }
 
+void
+ft_memmove(void* dst, const void* src, const u64 size) {
+    if (dst <= src) {
+        ft_memcpy(dst, src, size);
+        return;
+    }
+
+    char* dst_ptr = dst;
+    const char* src_ptr = src;
+    for (size_t i = size; i > 0; --i) {
+        dst_ptr[i - 1] = src_ptr[i - 1];
+    }
+}
+
 bool
 mmap_failed(void* ptr) {
     return (u64)ptr == (u64)-1;
 }
 
+void*
+map_pages(const u64 size, const bool populate) {
+    int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_POPULATE
+    if (populate) flags |= MAP_POPULATE;
+#endif
+
+    void* ptr = mmap(0, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+#ifndef MAP_POPULATE
+    if (populate && !mmap_failed(ptr)) prefault_pages(ptr, size);
+#endif
+
+    return ptr;
+}
+
+// Writes a zero to every page in the range, the caller must not need the bytes at page starts
+void
+prefault_pages(void* addr, const u64 size) {
+    const u64 page_size = getpagesize();
+    const u64 start = align_up((u64)addr, page_size);
+    for (u64 page = start; page < (u64)addr + size; page += page_size) {
+        *(volatile char*)page = 0;
+    }
+}
+
 u64
 ft_strlen(const char* str) {
     u64 len = 0;
@@ -34,17 +74,27 @@ ft_strlen(const char* str) {
     return len;
 }
 
+u64
+ft_atou(const char* str) {
+    u64 nbr = 0;
+    while (*str >= '0' && *str <= '9') {
+        nbr = nbr * 10 + (u64)(*str - '0');
+        ++str;
+    }
+    return nbr;
+}
+
 void
-ft_putstr(const char* str) {
-    write(STDOUT_FILENO, str, ft_strlen(str));
+ft_putstr_fd(const int fd, const char* str) {
+    write(fd, str, ft_strlen(str));
 }
 
 void
-ft_putnbr(const u64 nbr, const u64 base) {
+ft_putnbr_fd(const int fd, const u64 nbr, const u64 base) {
     const char* hex = "0123456789ABCDEF";
     if (nbr >= base) {
-        ft_putnbr(nbr / base, base);
+        ft_putnbr_fd(fd, nbr / base, base);
     }
     const char n = hex[nbr % base];
-    write(STDOUT_FILENO, &n, 1);
+    write(fd, &n, 1);
 }
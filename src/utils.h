@@ -13,14 +13,26 @@ align_up(const u64 addr, const u64 alignment);
 void
 ft_memcpy(void* dst, const void* src, const u64 size);
 
+void
+ft_memmove(void* dst, const void* src, const u64 size);
+
 bool
 mmap_failed(void* ptr);
 
+void*
+map_pages(const u64 size, const bool populate);
+
+void
+prefault_pages(void* addr, const u64 size);
+
 u64
 ft_strlen(const char* str);
 
+u64
+ft_atou(const char* str);
+
 void
-ft_putstr(const char* str);
+ft_putstr_fd(const int fd, const char* str);
 
 void
-ft_putnbr(const u64 nbr, const u64 base);
+ft_putnbr_fd(const int fd, const u64 nbr, const u64 base);